@@ -40,27 +40,81 @@
 #include "lv2/log/logger.h"
 #include "lv2/log/log.h"
 
+#include "beatbox_pattern.h"
+
 #include <math.h>
 #include <sfizz.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define DEFAULT_SFZ_FILE ""
 #define BEATBOX_URI "http://sfztools.github.io/beatbox"
 #define BEATBOX__beatDescription "http://sfztools.github.io/beatbox:beatdescription"
 #define BEATBOX__status "http://sfztools.github.io/beatbox:status"
+#define BEATBOX__pattern "http://sfztools.github.io/beatbox:pattern"
+#define BEATBOX__freePattern "http://sfztools.github.io/beatbox:freepattern"
+#define BEATBOX__stats "http://sfztools.github.io/beatbox:stats"
+#define BEATBOX__statsBlocks "http://sfztools.github.io/beatbox:statsblocks"
+#define BEATBOX__statsIdleBlocks "http://sfztools.github.io/beatbox:statsidleblocks"
+#define BEATBOX__statsRunTimeMin "http://sfztools.github.io/beatbox:statsruntimemin"
+#define BEATBOX__statsRunTimeMean "http://sfztools.github.io/beatbox:statsruntimemean"
+#define BEATBOX__statsRunTimeMax "http://sfztools.github.io/beatbox:statsruntimemax"
+#define BEATBOX__statsEvents "http://sfztools.github.io/beatbox:statsevents"
+#define BEATBOX__statsEventsMax "http://sfztools.github.io/beatbox:statseventsmax"
+#define BEATBOX__statsOverflows "http://sfztools.github.io/beatbox:statsoverflows"
+#define BEATBOX__statsWorkerPending "http://sfztools.github.io/beatbox:statsworkerpending"
+#define BEATBOX__statsWorkerLatency "http://sfztools.github.io/beatbox:statsworkerlatency"
+#define BEATBOX__statsWorkerLatencyMax "http://sfztools.github.io/beatbox:statsworkerlatencymax"
+#define BEATBOX__statsPatternSwaps "http://sfztools.github.io/beatbox:statspatternswaps"
 #define MAIN_SWITCH_ON "Switch on!"
 #define MAIN_SWITCH_OFF "Switch off!"
-#define CHANNEL_MASK 0x0F
 #define MIDI_CHANNEL(byte) (byte & CHANNEL_MASK)
 #define MIDI_STATUS(byte) (byte & ~CHANNEL_MASK)
 #define MAX_BLOCK_SIZE 8192
-#define MAX_PATH_SIZE 1024
 // #define MAX_VOICES 256
-#define DEFAULT_OUTPUT_CHANNEL 10
+#define RANDOM_SEED 0x9E3779B9
+// Frame time, atom header and 3 MIDI bytes padded to 64 bits
+#define MIDI_EVENT_SIZE (sizeof(int64_t) + sizeof(LV2_Atom) + 8)
 #define UNUSED(x) (void)(x)
 
+// Request sent to the worker to (re)compile a beat description
+typedef struct
+{
+    LV2_Atom atom;
+    uint32_t channel;        ///< Output channel for instruments without an explicit route channel
+    uint64_t scheduled_time; ///< When the request was scheduled, to measure the worker round-trip
+    char path[MAX_PATH_SIZE];
+} beatbox_load_request_t;
+
+// Compiled pattern handed over between the worker and the audio thread
+typedef struct
+{
+    LV2_Atom atom;
+    uint64_t scheduled_time;
+    beatbox_pattern_t *pattern; ///< NULL if the compilation failed
+} beatbox_pattern_message_t;
+
+// Performance counters, published through the stats parameter; times are in nanoseconds
+typedef struct
+{
+    uint64_t blocks;             ///< Blocks that went through the forges; the time is measured on those
+    uint64_t idle_blocks;        ///< Blocks skipped entirely because nothing was playing or changing
+    uint64_t run_time_min;
+    uint64_t run_time_max;
+    uint64_t run_time_total;
+    uint64_t events;             ///< MIDI events emitted
+    uint32_t events_max;         ///< Most MIDI events emitted in a single block
+    uint64_t overflows;          ///< Events dropped because an output buffer was full
+    uint32_t worker_pending;     ///< Compilations scheduled but not answered yet
+    uint64_t worker_latency;     ///< Last round-trip from schedule_work to work_response
+    uint64_t worker_latency_max;
+    uint64_t pattern_swaps;
+} beatbox_stats_t;
+
 typedef struct
 {
     // Features
@@ -71,14 +125,16 @@ typedef struct
 
     // Ports
     const LV2_Atom_Sequence *input_p;
-    LV2_Atom_Sequence *output_p;
+    LV2_Atom_Sequence *output_p[NUM_OUTPUT_PORTS];
     const float *output_channel_p;
     const float *main_p;
     const float *accent_p;
+    const float *lookahead_p;
+    float *latency_p;
 
-    // Atom forge
-    LV2_Atom_Forge forge;              ///< Forge for writing atoms in run thread
-    LV2_Atom_Forge_Frame notify_frame; ///< Cached for worker replies
+    // Atom forges, one per output port; the first one also carries the patch messages
+    LV2_Atom_Forge forge[NUM_OUTPUT_PORTS];              ///< Forges for writing atoms in run thread
+    LV2_Atom_Forge_Frame notify_frame[NUM_OUTPUT_PORTS]; ///< Cached for worker replies
 
     // Logger
     LV2_Log_Logger logger;
@@ -104,6 +160,21 @@ typedef struct
     LV2_URID state_changed_uri;
     LV2_URID bb_beat_description_uri;
     LV2_URID bb_status_uri;
+    LV2_URID bb_pattern_uri;
+    LV2_URID bb_free_pattern_uri;
+    LV2_URID bb_stats_uri;
+    LV2_URID bb_stats_blocks_uri;
+    LV2_URID bb_stats_idle_blocks_uri;
+    LV2_URID bb_stats_run_time_min_uri;
+    LV2_URID bb_stats_run_time_mean_uri;
+    LV2_URID bb_stats_run_time_max_uri;
+    LV2_URID bb_stats_events_uri;
+    LV2_URID bb_stats_events_max_uri;
+    LV2_URID bb_stats_overflows_uri;
+    LV2_URID bb_stats_worker_pending_uri;
+    LV2_URID bb_stats_worker_latency_uri;
+    LV2_URID bb_stats_worker_latency_max_uri;
+    LV2_URID bb_stats_pattern_swaps_uri;
 
     // Sfizz related data
     // sfizz_synth_t *synth;
@@ -117,6 +188,31 @@ typedef struct
     bool accent_switched;
     float sample_rate;
     unsigned int main_switched_count;
+
+    // Playback
+    beatbox_pattern_t *pattern;
+    bool playing;
+    uint64_t frame;         ///< Musical frame at the start of the block, lookahead frames ahead of the output
+    uint64_t next_step;     ///< Next step to play, counted since playback started
+    uint64_t anchor_frame;  ///< Frame of the anchor step
+    uint64_t anchor_step;   ///< Step from which the current step length applies
+    uint64_t step_frames_num; ///< Length of a step in frames, as the exact fraction step_frames_num / step_frames_den
+    uint64_t step_frames_den;
+    uint32_t lookahead;     ///< Frames by which the events are emitted ahead of the musical timeline
+    float lookahead_control; ///< Last value read on the lookahead port, in ms
+    bool fill_requested;
+    bool filling;
+    unsigned int fill_step;
+    uint64_t loop_count;       ///< Loops started since playback started
+    uint64_t loop_conditions;  ///< Condition bits of the current loop
+    uint32_t random_state;
+    const beatbox_event_t *releases; ///< Note offs due on the next step
+    unsigned int num_releases;
+    beatbox_event_t swap_releases[MAX_TRACKS]; ///< Pending note offs, copied when the pattern they belong to goes away
+
+    // Telemetry
+    beatbox_stats_t stats;
+    uint32_t block_events;
 } beatbox_plugin_t;
 
 enum
@@ -126,6 +222,11 @@ enum
     OUTPUT_CHANNEL_PORT,
     MAIN_SWITCH_PORT,
     ACCENT_SWITCH_PORT,
+    OUTPUT_PORT_2,
+    OUTPUT_PORT_3,
+    OUTPUT_PORT_4,
+    LOOKAHEAD_PORT,
+    LATENCY_PORT,
 };
 
 static void
@@ -151,6 +252,21 @@ sfizz_lv2_map_required_uris(beatbox_plugin_t *self)
     self->state_changed_uri = map->map(map->handle, LV2_STATE__StateChanged);
     self->bb_beat_description_uri = map->map(map->handle, BEATBOX__beatDescription);
     self->bb_status_uri = map->map(map->handle, BEATBOX__status);
+    self->bb_pattern_uri = map->map(map->handle, BEATBOX__pattern);
+    self->bb_free_pattern_uri = map->map(map->handle, BEATBOX__freePattern);
+    self->bb_stats_uri = map->map(map->handle, BEATBOX__stats);
+    self->bb_stats_blocks_uri = map->map(map->handle, BEATBOX__statsBlocks);
+    self->bb_stats_idle_blocks_uri = map->map(map->handle, BEATBOX__statsIdleBlocks);
+    self->bb_stats_run_time_min_uri = map->map(map->handle, BEATBOX__statsRunTimeMin);
+    self->bb_stats_run_time_mean_uri = map->map(map->handle, BEATBOX__statsRunTimeMean);
+    self->bb_stats_run_time_max_uri = map->map(map->handle, BEATBOX__statsRunTimeMax);
+    self->bb_stats_events_uri = map->map(map->handle, BEATBOX__statsEvents);
+    self->bb_stats_events_max_uri = map->map(map->handle, BEATBOX__statsEventsMax);
+    self->bb_stats_overflows_uri = map->map(map->handle, BEATBOX__statsOverflows);
+    self->bb_stats_worker_pending_uri = map->map(map->handle, BEATBOX__statsWorkerPending);
+    self->bb_stats_worker_latency_uri = map->map(map->handle, BEATBOX__statsWorkerLatency);
+    self->bb_stats_worker_latency_max_uri = map->map(map->handle, BEATBOX__statsWorkerLatencyMax);
+    self->bb_stats_pattern_swaps_uri = map->map(map->handle, BEATBOX__statsPatternSwaps);
 }
 
 static void
@@ -166,7 +282,12 @@ connect_port(LV2_Handle instance,
         self->input_p = (const LV2_Atom_Sequence *)data;
         break;
     case OUTPUT_PORT:
-        self->output_p = (LV2_Atom_Sequence *)data;
+        self->output_p[0] = (LV2_Atom_Sequence *)data;
+        break;
+    case OUTPUT_PORT_2:
+    case OUTPUT_PORT_3:
+    case OUTPUT_PORT_4:
+        self->output_p[port - OUTPUT_PORT_2 + 1] = (LV2_Atom_Sequence *)data;
         break;
     case OUTPUT_CHANNEL_PORT:
         self->output_channel_p = (const float *)data;
@@ -177,6 +298,12 @@ connect_port(LV2_Handle instance,
     case ACCENT_SWITCH_PORT:
         self->accent_p = (const float *)data;
         break;
+    case LOOKAHEAD_PORT:
+        self->lookahead_p = (const float *)data;
+        break;
+    case LATENCY_PORT:
+        self->latency_p = (float *)data;
+        break;
     default:
         break;
     }
@@ -209,6 +336,20 @@ instantiate(const LV2_Descriptor *descriptor,
     self->main_switched = false;
     self->accent_switched = false;
     self->main_switched_count = 0;
+    self->pattern = NULL;
+    self->playing = false;
+    self->lookahead = 0;
+    self->lookahead_control = 0.0f;
+    self->fill_requested = false;
+    self->filling = false;
+    self->releases = NULL;
+    self->num_releases = 0;
+    self->loop_count = 0;
+    self->loop_conditions = 0;
+    self->random_state = RANDOM_SEED;
+    self->step_frames_num = 0;
+    self->step_frames_den = 1;
+    self->stats.run_time_min = UINT64_MAX;
 
     // Get the features from the host and populate the structure
     for (const LV2_Feature *const *f = features; *f; f++)
@@ -259,8 +400,9 @@ instantiate(const LV2_Descriptor *descriptor,
     // Map the URIs we will need
     sfizz_lv2_map_required_uris(self);
 
-    // Initialize the forge
-    lv2_atom_forge_init(&self->forge, self->map);
+    // Initialize the forges
+    for (int i = 0; i < NUM_OUTPUT_PORTS; i++)
+        lv2_atom_forge_init(&self->forge[i], self->map);
 
     // Check the options for the block size and sample rate parameters
     if (options)
@@ -321,6 +463,7 @@ static void
 cleanup(LV2_Handle instance)
 {
     beatbox_plugin_t *self = (beatbox_plugin_t *)instance;
+    free(self->pattern);
     free(self);
 }
 
@@ -345,6 +488,35 @@ deactivate(LV2_Handle instance)
     // sfizz_free(self->synth);
 }
 
+static inline uint64_t
+beatbox_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void
+sfizz_lv2_schedule_load(beatbox_plugin_t *self, const char *path)
+{
+    const size_t path_size = strlen(path) + 1;
+    if (path_size > MAX_PATH_SIZE)
+    {
+        lv2_log_error(&self->logger, "[schedule_load] Path is too long, aborting.\n");
+        return;
+    }
+
+    beatbox_load_request_t request;
+    const uint32_t request_size = (uint32_t)(offsetof(beatbox_load_request_t, path) + path_size);
+    request.atom.type = self->bb_beat_description_uri;
+    request.atom.size = request_size - sizeof(LV2_Atom);
+    request.channel = self->output_channel;
+    request.scheduled_time = beatbox_time_ns();
+    memcpy(request.path, path, path_size);
+    if (self->worker->schedule_work(self->worker->handle, request_size, &request) == LV2_WORKER_SUCCESS)
+        self->stats.worker_pending++;
+}
+
 static void
 sfizz_lv2_handle_atom_object(beatbox_plugin_t *self, const LV2_Atom_Object *obj)
 {
@@ -390,7 +562,7 @@ sfizz_lv2_handle_atom_object(beatbox_plugin_t *self, const LV2_Atom_Object *obj)
 
         // If the parameter is different from the current one we send it through
         if (strcmp(self->beat_file_path, LV2_ATOM_BODY_CONST(sfz_file_path)))
-            self->worker->schedule_work(self->worker->handle, null_terminated_atom_size, sfz_file_path);
+            sfizz_lv2_schedule_load(self, LV2_ATOM_BODY_CONST(sfz_file_path));
         lv2_log_note(&self->logger, "[handle_object] Received a description file: %s\n", (char *)LV2_ATOM_BODY_CONST(sfz_file_path));
     }
     else
@@ -447,63 +619,307 @@ sfizz_lv2_process_midi_event(beatbox_plugin_t *self, const LV2_Atom_Event *ev)
 static void sfizz_lv2_send_file_path(beatbox_plugin_t *self)
 {
     LV2_Atom_Forge_Frame frame;
-    lv2_atom_forge_frame_time(&self->forge, 0);
-    lv2_atom_forge_object(&self->forge, &frame, 0, self->patch_set_uri);
-    lv2_atom_forge_key(&self->forge, self->patch_property_uri);
-    lv2_atom_forge_urid(&self->forge, self->bb_beat_description_uri);
-    lv2_atom_forge_key(&self->forge, self->patch_value_uri);
-    lv2_atom_forge_path(&self->forge, self->beat_file_path, strlen(self->beat_file_path));
-    lv2_atom_forge_pop(&self->forge, &frame);
+    lv2_atom_forge_frame_time(&self->forge[0], 0);
+    lv2_atom_forge_object(&self->forge[0], &frame, 0, self->patch_set_uri);
+    lv2_atom_forge_key(&self->forge[0], self->patch_property_uri);
+    lv2_atom_forge_urid(&self->forge[0], self->bb_beat_description_uri);
+    lv2_atom_forge_key(&self->forge[0], self->patch_value_uri);
+    lv2_atom_forge_path(&self->forge[0], self->beat_file_path, strlen(self->beat_file_path));
+    lv2_atom_forge_pop(&self->forge[0], &frame);
 }
 
 static void sfizz_lv2_send_status(beatbox_plugin_t *self)
 {
     LV2_Atom_Forge_Frame frame;
-    lv2_atom_forge_frame_time(&self->forge, 0);
-    lv2_atom_forge_object(&self->forge, &frame, 0, self->patch_set_uri);
-    lv2_atom_forge_key(&self->forge, self->patch_property_uri);
-    lv2_atom_forge_urid(&self->forge, self->bb_status_uri);
-    lv2_atom_forge_key(&self->forge, self->patch_value_uri);
+    lv2_atom_forge_frame_time(&self->forge[0], 0);
+    lv2_atom_forge_object(&self->forge[0], &frame, 0, self->patch_set_uri);
+    lv2_atom_forge_key(&self->forge[0], self->patch_property_uri);
+    lv2_atom_forge_urid(&self->forge[0], self->bb_status_uri);
+    lv2_atom_forge_key(&self->forge[0], self->patch_value_uri);
     if (self->main_switched)
-        lv2_atom_forge_string(&self->forge, MAIN_SWITCH_ON, strlen(MAIN_SWITCH_ON));
+        lv2_atom_forge_string(&self->forge[0], MAIN_SWITCH_ON, strlen(MAIN_SWITCH_ON));
     else
-        lv2_atom_forge_string(&self->forge, MAIN_SWITCH_OFF, strlen(MAIN_SWITCH_OFF));
+        lv2_atom_forge_string(&self->forge[0], MAIN_SWITCH_OFF, strlen(MAIN_SWITCH_OFF));
+
+    lv2_atom_forge_pop(&self->forge[0], &frame);
+}
 
-    lv2_atom_forge_pop(&self->forge, &frame);
+static void sfizz_lv2_send_stats(beatbox_plugin_t *self)
+{
+    const beatbox_stats_t *stats = &self->stats;
+    LV2_Atom_Forge *forge = &self->forge[0];
+    LV2_Atom_Forge_Frame frame;
+    LV2_Atom_Forge_Frame stats_frame;
+    lv2_atom_forge_frame_time(forge, 0);
+    lv2_atom_forge_object(forge, &frame, 0, self->patch_set_uri);
+    lv2_atom_forge_key(forge, self->patch_property_uri);
+    lv2_atom_forge_urid(forge, self->bb_stats_uri);
+    lv2_atom_forge_key(forge, self->patch_value_uri);
+    lv2_atom_forge_object(forge, &stats_frame, 0, self->bb_stats_uri);
+    lv2_atom_forge_key(forge, self->bb_stats_blocks_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->blocks);
+    lv2_atom_forge_key(forge, self->bb_stats_idle_blocks_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->idle_blocks);
+    lv2_atom_forge_key(forge, self->bb_stats_run_time_min_uri);
+    lv2_atom_forge_long(forge, stats->blocks ? (int64_t)stats->run_time_min : 0);
+    lv2_atom_forge_key(forge, self->bb_stats_run_time_mean_uri);
+    lv2_atom_forge_long(forge, stats->blocks ? (int64_t)(stats->run_time_total / stats->blocks) : 0);
+    lv2_atom_forge_key(forge, self->bb_stats_run_time_max_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->run_time_max);
+    lv2_atom_forge_key(forge, self->bb_stats_events_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->events);
+    lv2_atom_forge_key(forge, self->bb_stats_events_max_uri);
+    lv2_atom_forge_int(forge, (int32_t)stats->events_max);
+    lv2_atom_forge_key(forge, self->bb_stats_overflows_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->overflows);
+    lv2_atom_forge_key(forge, self->bb_stats_worker_pending_uri);
+    lv2_atom_forge_int(forge, (int32_t)stats->worker_pending);
+    lv2_atom_forge_key(forge, self->bb_stats_worker_latency_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->worker_latency);
+    lv2_atom_forge_key(forge, self->bb_stats_worker_latency_max_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->worker_latency_max);
+    lv2_atom_forge_key(forge, self->bb_stats_pattern_swaps_uri);
+    lv2_atom_forge_long(forge, (int64_t)stats->pattern_swaps);
+    lv2_atom_forge_pop(forge, &stats_frame);
+    lv2_atom_forge_pop(forge, &frame);
 }
 
 // static void sfizz_lv2_send_all(beatbox_plugin_t *self)
 // {
 //     static const char *status_line = "Here is my status!";
 //     LV2_Atom_Forge_Frame frame;
-//     lv2_atom_forge_frame_time(&self->forge, 0);
-//     lv2_atom_forge_object(&self->forge, &frame, 0, self->patch_set_uri);
-//     lv2_atom_forge_key(&self->forge, self->patch_property_uri);
-//     lv2_atom_forge_urid(&self->forge, self->bb_beat_description_uri);
-//     lv2_atom_forge_key(&self->forge, self->patch_value_uri);
-//     lv2_atom_forge_path(&self->forge, self->beat_file_path, strlen(self->beat_file_path));
-//     lv2_atom_forge_key(&self->forge, self->patch_property_uri);
-//     lv2_atom_forge_urid(&self->forge, self->bb_status_uri);
-//     lv2_atom_forge_key(&self->forge, self->patch_value_uri);
-//     lv2_atom_forge_string(&self->forge, status_line, strlen(status_line));
-//     lv2_atom_forge_pop(&self->forge, &frame);
+//     lv2_atom_forge_frame_time(&self->forge[0], 0);
+//     lv2_atom_forge_object(&self->forge[0], &frame, 0, self->patch_set_uri);
+//     lv2_atom_forge_key(&self->forge[0], self->patch_property_uri);
+//     lv2_atom_forge_urid(&self->forge[0], self->bb_beat_description_uri);
+//     lv2_atom_forge_key(&self->forge[0], self->patch_value_uri);
+//     lv2_atom_forge_path(&self->forge[0], self->beat_file_path, strlen(self->beat_file_path));
+//     lv2_atom_forge_key(&self->forge[0], self->patch_property_uri);
+//     lv2_atom_forge_urid(&self->forge[0], self->bb_status_uri);
+//     lv2_atom_forge_key(&self->forge[0], self->patch_value_uri);
+//     lv2_atom_forge_string(&self->forge[0], status_line, strlen(status_line));
+//     lv2_atom_forge_pop(&self->forge[0], &frame);
 // }
 
+// Frame at which a step is due. This is exact integer arithmetic, split so that it cannot
+// overflow, so the timing neither drifts nor depends on the block size.
+static inline uint64_t
+beatbox_step_frame(const beatbox_plugin_t *self, uint64_t step)
+{
+    const uint64_t steps = step - self->anchor_step;
+    const uint64_t den = self->step_frames_den;
+    return self->anchor_frame
+           + (steps / den) * self->step_frames_num
+           + (steps % den) * self->step_frames_num / den;
+}
+
+// Called when the pattern or the sample rate changes
 static void
-run(LV2_Handle instance, uint32_t sample_count)
+beatbox_update_step_length(beatbox_plugin_t *self)
 {
-    UNUSED(sample_count);
-    beatbox_plugin_t *self = (beatbox_plugin_t *)instance;
-    if (!self->input_p || !self->output_p)
+    // The next step stays where it was due and the new pace applies from there
+    const uint64_t next_step_frame = beatbox_step_frame(self, self->next_step);
+    self->anchor_frame = next_step_frame > self->frame ? next_step_frame : self->frame;
+    self->anchor_step = self->next_step;
+    if (self->pattern)
+    {
+        // The sample rate is taken to the Hz and the tempo to the thousandth of a BPM
+        self->step_frames_num = 60ull * 1000ull * (uint64_t)(self->sample_rate + 0.5f);
+        self->step_frames_den = (uint64_t)(self->pattern->tempo * 1000.0f + 0.5f) * self->pattern->division;
+    }
+    else
+    {
+        self->step_frames_num = 0;
+        self->step_frames_den = 1;
+    }
+}
+
+static inline void
+beatbox_forge_event(beatbox_plugin_t *self, uint32_t time, const beatbox_event_t *event)
+{
+    LV2_Atom_Forge *forge = &self->forge[event->port];
+
+    // Check that the whole event fits, a partial write would corrupt the sequence
+    if (forge->offset + MIDI_EVENT_SIZE > forge->size)
+    {
+        // Unconnected ports have no buffer at all and are not overflowing
+        if (forge->size > 0)
+            self->stats.overflows++;
         return;
+    }
 
-    // Set up forge to write directly to notify output port.
-    const size_t notify_capacity = self->output_p->atom.size;
-    lv2_atom_forge_set_buffer(&self->forge, (uint8_t *)self->output_p, notify_capacity);
+    lv2_atom_forge_frame_time(forge, time);
+    lv2_atom_forge_atom(forge, 3, self->midi_event_uri);
+    lv2_atom_forge_write(forge, &event->status, 3);
+    self->block_events++;
+}
 
-    // Start a sequence in the notify output port.
-    lv2_atom_forge_sequence_head(&self->forge, &self->notify_frame, 0);
+static void
+beatbox_release(beatbox_plugin_t *self, uint32_t time)
+{
+    const beatbox_event_t *const end = self->releases + self->num_releases;
+    for (const beatbox_event_t *event = self->releases; event < end; event++)
+        beatbox_forge_event(self, time, event);
+    self->num_releases = 0;
+}
+
+// Called before the current pattern goes away
+static void
+beatbox_keep_releases(beatbox_plugin_t *self)
+{
+    // releases may be NULL when nothing is pending, which memmove does not accept
+    if (self->num_releases)
+        memmove(self->swap_releases, self->releases, self->num_releases * sizeof(beatbox_event_t));
+    self->releases = self->swap_releases;
+    // A fill requested on the old pattern does not carry over to the new one, which may have none
+    self->fill_requested = false;
+    self->filling = false;
+}
+
+// xorshift32, so that probabilities cost a few instructions per event
+static inline uint32_t
+beatbox_random(beatbox_plugin_t *self)
+{
+    uint32_t x = self->random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self->random_state = x;
+    return x;
+}
+
+static uint64_t
+beatbox_loop_conditions(uint64_t loop)
+{
+    uint64_t conditions = 0;
+    for (uint64_t period = 1; period <= MAX_LOOP_PERIOD; period++)
+        conditions |= CONDITION_LOOP_BIT(loop % period, period);
+    return conditions;
+}
+
+static void
+beatbox_start(beatbox_plugin_t *self)
+{
+    self->playing = true;
+    // The musical timeline runs lookahead frames ahead of the output. Step 0 is anchored on the
+    // first output frame so that the steps of a count-in keep their spacing instead of piling up.
+    self->frame = self->lookahead;
+    self->next_step = 0;
+    self->anchor_frame = self->lookahead;
+    self->anchor_step = 0;
+    self->fill_requested = false;
+    self->filling = false;
+    self->loop_count = 0;
+    self->loop_conditions = beatbox_loop_conditions(0);
+    self->random_state = RANDOM_SEED;
+}
+
+static void
+beatbox_stop(beatbox_plugin_t *self)
+{
+    self->playing = false;
+    self->fill_requested = false;
+    self->filling = false;
+    beatbox_release(self, 0);
+}
+
+static void
+beatbox_play(beatbox_plugin_t *self, uint32_t sample_count)
+{
+    const uint64_t block_end = self->frame + sample_count;
+    const beatbox_pattern_t *pattern = self->pattern;
+    if (pattern)
+    {
+        uint64_t step_frame;
+        while ((step_frame = beatbox_step_frame(self, self->next_step)) < block_end)
+        {
+            const uint32_t time = step_frame > self->frame ? (uint32_t)(step_frame - self->frame) : 0;
+            unsigned int step = (unsigned int)(self->next_step % pattern->num_steps);
+            if (step == 0 && self->next_step > 0)
+                self->loop_conditions = beatbox_loop_conditions(++self->loop_count);
+
+            // Transitions are decided on the musical step, which the block reaches lookahead frames
+            // before it is heard, so a requested fill always ends on the downbeat
+            if (self->fill_requested && pattern->num_fill_steps > 0 && step == pattern->fill_start)
+            {
+                self->fill_requested = false;
+                self->filling = true;
+                self->fill_step = 0;
+            }
 
+            // The step conditions reduce to a mask test and a single random draw per event.
+            // The fill bit is taken before the fill moves on, so that its last step is still part of it.
+            const uint64_t state = self->loop_conditions
+                                   | ((self->filling || self->fill_requested) ? CONDITION_FILL : CONDITION_NOT_FILL);
+
+            if (self->filling)
+            {
+                step = pattern->num_steps + self->fill_step;
+                if (++self->fill_step == pattern->num_fill_steps)
+                    self->filling = false;
+            }
+            beatbox_release(self, time);
+            const beatbox_event_t *event = &pattern->events[pattern->step_index[step]];
+            const beatbox_event_t *const end = &pattern->events[pattern->release_index[step]];
+            for (; event < end; event++)
+            {
+                const uint32_t random = beatbox_random(self);
+                if (((state & event->condition) == event->condition) & (random <= event->threshold))
+                    beatbox_forge_event(self, time, event);
+            }
+            self->releases = end;
+            self->num_releases = pattern->step_index[step + 1] - pattern->release_index[step];
+            self->next_step++;
+        }
+    }
+    self->frame = block_end;
+}
+
+// True if a control port moved since the last block
+static inline bool
+beatbox_controls_changed(const beatbox_plugin_t *self)
+{
+    return (bool)*self->main_p != self->main_switched
+        || (bool)*self->accent_p != self->accent_switched
+        || (unsigned int)*self->output_channel_p != self->output_channel
+        || (!self->playing && self->lookahead_p && *self->lookahead_p != self->lookahead_control);
+}
+
+// Leave empty sequences in the outputs without going through the forges
+static void
+beatbox_clear_outputs(beatbox_plugin_t *self)
+{
+    for (int i = 0; i < NUM_OUTPUT_PORTS; i++)
+    {
+        LV2_Atom_Sequence *output = self->output_p[i];
+        if (!output)
+            continue;
+
+        output->atom.size = sizeof(LV2_Atom_Sequence_Body);
+        output->atom.type = self->forge[i].Sequence;
+        output->body.unit = 0;
+        output->body.pad = 0;
+    }
+}
+
+// Set up the forges to write directly to the output ports, and start a sequence in each.
+// Unconnected ports get an empty buffer so that the events routed there are dropped.
+static void
+beatbox_begin_outputs(beatbox_plugin_t *self)
+{
+    for (int i = 0; i < NUM_OUTPUT_PORTS; i++)
+    {
+        LV2_Atom_Sequence *output = self->output_p[i];
+        const size_t capacity = output ? output->atom.size : 0;
+        lv2_atom_forge_set_buffer(&self->forge[i], (uint8_t *)output, capacity);
+        lv2_atom_forge_sequence_head(&self->forge[i], &self->notify_frame[i], 0);
+    }
+}
+
+// The general path, for blocks with input events or control changes
+static void
+sfizz_lv2_process_input(beatbox_plugin_t *self)
+{
     LV2_ATOM_SEQUENCE_FOREACH(self->input_p, ev)
     {
         // If the received atom is an object/patch message
@@ -525,6 +941,7 @@ run(LV2_Handle instance, uint32_t sample_count)
                     lv2_log_warning(&self->logger, "Got an Patch GET with no body.\n");
                     sfizz_lv2_send_file_path(self);
                     sfizz_lv2_send_status(self);
+                    sfizz_lv2_send_stats(self);
                 }
                 else if (property->body == self->bb_beat_description_uri)
                 {
@@ -536,6 +953,11 @@ run(LV2_Handle instance, uint32_t sample_count)
                     lv2_log_warning(&self->logger, "Got an Patch GET for the status.\n");
                     sfizz_lv2_send_status(self);
                 }
+                else if (property->body == self->bb_stats_uri)
+                {
+                    lv2_log_warning(&self->logger, "Got an Patch GET for the statistics.\n");
+                    sfizz_lv2_send_stats(self);
+                }
             }
             else
             {
@@ -559,7 +981,19 @@ run(LV2_Handle instance, uint32_t sample_count)
     {
         lv2_log_note(&self->logger, "[run] Changed output channel to %d\n", output_channel);
         self->output_channel = output_channel;
+        // The channels are resolved when compiling so we need to go through the worker again
+        if (strlen(self->beat_file_path) > 0)
+            sfizz_lv2_schedule_load(self, self->beat_file_path);
     }
+
+    // The lookahead only changes while stopped so that the timeline never jumps,
+    // and is read before the main switch so that a start in this block uses it
+    if (!self->playing && self->lookahead_p)
+    {
+        self->lookahead_control = *self->lookahead_p;
+        self->lookahead = (uint32_t)(self->lookahead_control * self->sample_rate / 1000.0f);
+    }
+
     // if ((bool)*self->main_p)
     // {
     //     self->main_switched = true;
@@ -572,17 +1006,83 @@ run(LV2_Handle instance, uint32_t sample_count)
     // }
     if ((bool)*self->main_p)
     {
-        self->main_switched = true;
-        lv2_log_note(&self->logger, "[run] Main switch pressed\n");
-        sfizz_lv2_send_status(self);
+        if (!self->main_switched)
+        {
+            if (self->playing)
+                beatbox_stop(self);
+            else
+                beatbox_start(self);
+            self->main_switched = true;
+            lv2_log_note(&self->logger, "[run] Main switch pressed\n");
+            sfizz_lv2_send_status(self);
+        }
     }
-    else
+    else if (self->main_switched)
     {
         self->main_switched = false;
         sfizz_lv2_send_status(self);
-        /* code */
     }
-    
+
+    if ((bool)*self->accent_p)
+    {
+        if (!self->accent_switched && self->playing && self->pattern && self->pattern->num_fill_steps > 0)
+        {
+            lv2_log_note(&self->logger, "[run] Fill requested\n");
+            self->fill_requested = true;
+        }
+        self->accent_switched = true;
+    }
+    else
+    {
+        self->accent_switched = false;
+    }
+
+}
+
+static void
+run(LV2_Handle instance, uint32_t sample_count)
+{
+    beatbox_plugin_t *self = (beatbox_plugin_t *)instance;
+    if (!self->input_p || !self->output_p[0])
+        return;
+
+    // Most blocks have no input event and no control change, and get a specialized path:
+    // nothing at all when stopped, and only the pattern when playing.
+    const bool quiet = self->input_p->atom.size <= sizeof(LV2_Atom_Sequence_Body)
+                       && !beatbox_controls_changed(self);
+    if (quiet && !self->playing)
+    {
+        beatbox_clear_outputs(self);
+        if (self->latency_p)
+            *self->latency_p = (float)self->lookahead;
+        self->stats.idle_blocks++;
+        return;
+    }
+
+    const uint64_t run_start_time = beatbox_time_ns();
+    self->block_events = 0;
+    beatbox_begin_outputs(self);
+
+    if (!quiet)
+        sfizz_lv2_process_input(self);
+
+    if (self->latency_p)
+        *self->latency_p = (float)self->lookahead;
+
+    if (self->playing)
+        beatbox_play(self, sample_count);
+
+    beatbox_stats_t *stats = &self->stats;
+    const uint64_t run_time = beatbox_time_ns() - run_start_time;
+    stats->blocks++;
+    stats->run_time_total += run_time;
+    if (run_time < stats->run_time_min)
+        stats->run_time_min = run_time;
+    if (run_time > stats->run_time_max)
+        stats->run_time_max = run_time;
+    stats->events += self->block_events;
+    if (self->block_events > stats->events_max)
+        stats->events_max = self->block_events;
 
     // const float *const accent_sentinel = self->accent_p + sample_count;
     // for (const float *accent = self->accent_p; accent < accent_sentinel; accent++)
@@ -631,6 +1131,7 @@ lv2_set_options(LV2_Handle instance, const LV2_Options_Option *options)
                 continue;
             }
             self->sample_rate = *(float *)opt->value;
+            beatbox_update_step_length(self);
             // sfizz_set_sample_rate(self->synth, self->sample_rate);
         }
         else if (!self->expect_nominal_block_length && opt->key == self->max_block_length_uri)
@@ -680,6 +1181,17 @@ restore(LV2_Handle instance,
         // if (sfizz_load_file(self->synth, (const char *)value))
         //     strcpy(self->sfz_file_path, (const char *)value);
         strcpy(self->beat_file_path, (const char *)value);
+
+        // We are not running concurrently with run() here so the pattern can be swapped directly
+        beatbox_pattern_t *pattern = beatbox_pattern_load(&self->logger, self->beat_file_path, self->output_channel);
+        if (pattern)
+        {
+            beatbox_keep_releases(self);
+            free(self->pattern);
+            self->pattern = pattern;
+            beatbox_update_step_length(self);
+            self->stats.pattern_swaps++;
+        }
     }
     return LV2_STATE_SUCCESS;
 }
@@ -713,6 +1225,7 @@ work(LV2_Handle instance,
      uint32_t size,
      const void *data)
 {
+    UNUSED(size);
     beatbox_plugin_t *self = (beatbox_plugin_t *)instance;
     if (!data)
     {
@@ -723,9 +1236,23 @@ work(LV2_Handle instance,
     const LV2_Atom *atom = (const LV2_Atom *)data;
     if (atom->type == self->bb_beat_description_uri)
     {
-        const char *sfz_file_path = LV2_ATOM_BODY_CONST(atom);
-        lv2_log_note(&self->logger, "[work] Loading file: %s\n", sfz_file_path);
-        // sfizz_load_file(self->synth, sfz_file_path);
+        const beatbox_load_request_t *request = (const beatbox_load_request_t *)data;
+        lv2_log_note(&self->logger, "[work] Loading file: %s\n", request->path);
+        beatbox_pattern_message_t message;
+        message.atom.size = sizeof(beatbox_pattern_message_t) - sizeof(LV2_Atom);
+        message.atom.type = self->bb_pattern_uri;
+        message.scheduled_time = request->scheduled_time;
+        message.pattern = beatbox_pattern_load(&self->logger, request->path, request->channel);
+
+        // Answer even on failure so that the audio thread can account for the request
+        respond(handle, sizeof(message), &message);
+        if (!message.pattern)
+            return LV2_WORKER_ERR_UNKNOWN;
+    }
+    else if (atom->type == self->bb_free_pattern_uri)
+    {
+        const beatbox_pattern_message_t *message = (const beatbox_pattern_message_t *)data;
+        free(message->pattern);
     }
     else
     {
@@ -737,7 +1264,6 @@ work(LV2_Handle instance,
         return LV2_WORKER_ERR_UNKNOWN;
     }
 
-    respond(handle, size, data);
     return LV2_WORKER_SUCCESS;
 }
 
@@ -754,11 +1280,37 @@ work_response(LV2_Handle instance,
         return LV2_WORKER_ERR_UNKNOWN;
 
     const LV2_Atom *atom = (const LV2_Atom *)data;
-    if (atom->type == self->bb_beat_description_uri)
+    if (atom->type == self->bb_pattern_uri)
     {
-        const char *beat_file_path = LV2_ATOM_BODY_CONST(atom);
-        strcpy(self->beat_file_path, beat_file_path);
+        const beatbox_pattern_message_t *message = (const beatbox_pattern_message_t *)data;
+        beatbox_stats_t *stats = &self->stats;
+        stats->worker_pending--;
+        stats->worker_latency = beatbox_time_ns() - message->scheduled_time;
+        if (stats->worker_latency > stats->worker_latency_max)
+            stats->worker_latency_max = stats->worker_latency;
+
+        if (!message->pattern)
+        {
+            lv2_log_error(&self->logger, "[work_response] The beat description could not be compiled.\n");
+            return LV2_WORKER_SUCCESS;
+        }
+
+        beatbox_pattern_message_t old_pattern;
+        old_pattern.atom.size = sizeof(beatbox_pattern_message_t) - sizeof(LV2_Atom);
+        old_pattern.atom.type = self->bb_free_pattern_uri;
+        old_pattern.scheduled_time = 0;
+        old_pattern.pattern = self->pattern;
+
+        beatbox_keep_releases(self);
+        self->pattern = message->pattern;
+        beatbox_update_step_length(self);
+        stats->pattern_swaps++;
+        strcpy(self->beat_file_path, self->pattern->path);
         lv2_log_note(&self->logger, "[work_response] File changed to: %s\n", self->beat_file_path);
+
+        // Send the old pattern back to the worker to be freed
+        if (old_pattern.pattern)
+            self->worker->schedule_work(self->worker->handle, sizeof(old_pattern), &old_pattern);
     }
     else
     {
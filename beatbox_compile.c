@@ -0,0 +1,375 @@
+/*
+  Beatbox LV2 plugin
+
+  Copyright 2019, Paul Ferrand <paul@ferrand.cc>
+
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+// Compile a whole library of beat descriptions ahead of time, so that the
+// plugin finds up to date caches instead of parsing files on first use.
+
+#include "beatbox_pattern.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BEAT_FILE_EXTENSION ".beat"
+#define INDEX_FILE_NAME "beatbox.index"
+
+typedef enum
+{
+    FILE_FAILED = 0,
+    FILE_COMPILED,
+    FILE_SKIPPED,
+} file_status_t;
+
+typedef struct
+{
+    char path[MAX_PATH_SIZE];
+    uint64_t hash;
+    file_status_t status;
+} library_file_t;
+
+typedef struct
+{
+    library_file_t *files;
+    size_t num_files;
+    size_t capacity;
+    atomic_size_t next_file; ///< Threads take the next file from here until none are left
+    unsigned int channel;
+    bool force;
+    bool verbose;
+    LV2_URID_Map map;
+    LV2_Log_Log log;
+    LV2_Log_Logger logger;
+} library_t;
+
+// Only the log types are mapped, so that the logger can tell the notes apart
+static LV2_URID
+map_uri(LV2_URID_Map_Handle handle, const char *uri)
+{
+    (void)handle;
+    static const char *const uris[] = { LV2_LOG__Error, LV2_LOG__Note, LV2_LOG__Trace, LV2_LOG__Warning };
+    for (size_t i = 0; i < sizeof(uris) / sizeof(uris[0]); i++)
+        if (!strcmp(uri, uris[i]))
+            return (LV2_URID)(i + 1);
+    return 0;
+}
+
+// Notes are printed for every file, so they only show up in verbose mode
+static int
+log_vprintf(LV2_Log_Handle handle, LV2_URID type, const char *format, va_list args)
+{
+    const library_t *library = (const library_t *)handle;
+    if (!library->verbose && (type == library->logger.Note || type == library->logger.Trace))
+        return 0;
+    return vfprintf(stderr, format, args);
+}
+
+static int
+log_printf(LV2_Log_Handle handle, LV2_URID type, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    const int result = log_vprintf(handle, type, format, args);
+    va_end(args);
+    return result;
+}
+
+static bool
+has_extension(const char *name, const char *extension)
+{
+    const size_t name_length = strlen(name);
+    const size_t extension_length = strlen(extension);
+    return name_length > extension_length
+           && !strcmp(name + name_length - extension_length, extension);
+}
+
+static bool
+add_file(library_t *library, const char *path)
+{
+    if (library->num_files == library->capacity)
+    {
+        const size_t capacity = library->capacity ? 2 * library->capacity : 256;
+        library_file_t *files = (library_file_t *)realloc(library->files, capacity * sizeof(library_file_t));
+        if (!files)
+            return false;
+        library->files = files;
+        library->capacity = capacity;
+    }
+
+    library_file_t *file = &library->files[library->num_files++];
+    strcpy(file->path, path);
+    file->hash = 0;
+    file->status = FILE_FAILED;
+    return true;
+}
+
+static bool
+scan_directory(library_t *library, const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (!dir)
+    {
+        fprintf(stderr, "Could not open the directory %s\n", directory);
+        return false;
+    }
+
+    bool success = true;
+    struct dirent *entry;
+    while (success && (entry = readdir(dir)))
+    {
+        // Skips ., .. and hidden entries
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char path[MAX_PATH_SIZE];
+        if (snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name) >= (int)sizeof(path))
+        {
+            fprintf(stderr, "Path too long, skipping %s/%s\n", directory, entry->d_name);
+            continue;
+        }
+
+        // Symbolic links are not followed to avoid cycles
+        struct stat info;
+        if (lstat(path, &info) != 0)
+            continue;
+
+        if (S_ISDIR(info.st_mode))
+            success = scan_directory(library, path);
+        else if (S_ISREG(info.st_mode) && has_extension(entry->d_name, BEAT_FILE_EXTENSION))
+            success = add_file(library, path);
+    }
+    closedir(dir);
+    return success;
+}
+
+static void
+compile_file(library_t *library, library_file_t *file)
+{
+    // The file is read once, so that the cache gets the hash of the content actually compiled
+    size_t size;
+    char *data = beatbox_pattern_read(file->path, &size, &file->hash);
+    if (!data)
+    {
+        fprintf(stderr, "Could not read %s\n", file->path);
+        return;
+    }
+
+    if (!library->force)
+    {
+        beatbox_pattern_t *cached = beatbox_pattern_read_cache(file->path, file->hash, library->channel);
+        if (cached)
+        {
+            free(cached);
+            free(data);
+            file->status = FILE_SKIPPED;
+            return;
+        }
+    }
+
+    beatbox_pattern_t *pattern = beatbox_pattern_compile(&library->logger, file->path, data, size, library->channel);
+    free(data);
+    if (!pattern)
+        return;
+
+    if (beatbox_pattern_write_cache(pattern, file->hash, library->channel))
+        file->status = FILE_COMPILED;
+    else
+        fprintf(stderr, "Could not write the cache of %s\n", file->path);
+    free(pattern);
+}
+
+static void *
+compile_thread(void *data)
+{
+    library_t *library = (library_t *)data;
+    for (;;)
+    {
+        const size_t index = atomic_fetch_add(&library->next_file, 1);
+        if (index >= library->num_files)
+            break;
+        compile_file(library, &library->files[index]);
+    }
+    return NULL;
+}
+
+static bool
+write_index(const library_t *library, const char *directory)
+{
+    char index_path[MAX_PATH_SIZE];
+    snprintf(index_path, sizeof(index_path), "%s/%s", directory, INDEX_FILE_NAME);
+    FILE *index = fopen(index_path, "w");
+    if (!index)
+        return false;
+
+    // One line per compiled file: <content hash> <path relative to the library>
+    const size_t prefix_length = strlen(directory) + 1;
+    for (size_t i = 0; i < library->num_files; i++)
+    {
+        const library_file_t *file = &library->files[i];
+        if (file->status != FILE_FAILED)
+            fprintf(index, "%016llx %s\n", (unsigned long long)file->hash, file->path + prefix_length);
+    }
+    return fclose(index) == 0;
+}
+
+static int
+compare_files(const void *lhs, const void *rhs)
+{
+    return strcmp(((const library_file_t *)lhs)->path, ((const library_file_t *)rhs)->path);
+}
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-c channel] [-j jobs] [-f] [-v] <directory>\n"
+            "Compiles every *" BEAT_FILE_EXTENSION " file below <directory> into its cache,\n"
+            "and writes an index of the library in <directory>/" INDEX_FILE_NAME ".\n"
+            "  -c channel  default output channel, as set on the plugin (default %d)\n"
+            "  -j jobs     number of threads (default: number of cores)\n"
+            "  -f          compile even the files whose cache is up to date\n"
+            "  -v          print a line for every compiled file\n",
+            program, DEFAULT_OUTPUT_CHANNEL);
+}
+
+int
+main(int argc, char **argv)
+{
+    library_t library;
+    memset(&library, 0, sizeof(library));
+    library.channel = DEFAULT_OUTPUT_CHANNEL;
+    library.map.map = map_uri;
+    library.log.handle = &library;
+    library.log.printf = log_printf;
+    library.log.vprintf = log_vprintf;
+    lv2_log_logger_init(&library.logger, &library.map, &library.log);
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int option;
+    while ((option = getopt(argc, argv, "c:j:fvh")) != -1)
+    {
+        switch (option)
+        {
+        case 'c':
+            library.channel = (unsigned int)atoi(optarg);
+            break;
+        case 'j':
+            num_threads = atol(optarg);
+            break;
+        case 'f':
+            library.force = true;
+            break;
+        case 'v':
+            library.verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || library.channel < 1 || library.channel > 16)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Strip the trailing slashes so that the index holds clean relative paths
+    char directory[MAX_PATH_SIZE];
+    snprintf(directory, sizeof(directory), "%s", argv[optind]);
+    for (size_t length = strlen(directory); length > 1 && directory[length - 1] == '/'; length--)
+        directory[length - 1] = '\0';
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (!scan_directory(&library, directory))
+    {
+        free(library.files);
+        return EXIT_FAILURE;
+    }
+
+    // Sorting keeps the index stable from one run to the next
+    qsort(library.files, library.num_files, sizeof(library_file_t), compare_files);
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if ((size_t)num_threads > library.num_files)
+        num_threads = library.num_files > 0 ? (long)library.num_files : 1;
+
+    pthread_t *threads = (pthread_t *)calloc((size_t)num_threads, sizeof(pthread_t));
+    if (!threads)
+    {
+        free(library.files);
+        return EXIT_FAILURE;
+    }
+
+    atomic_init(&library.next_file, 0);
+    long num_started = 0;
+    for (; num_started < num_threads; num_started++)
+    {
+        if (pthread_create(&threads[num_started], NULL, compile_thread, &library) != 0)
+            break;
+    }
+
+    // If no thread could start, the main thread does all the work
+    if (num_started == 0)
+        compile_thread(&library);
+    for (long i = 0; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    size_t num_compiled = 0;
+    size_t num_skipped = 0;
+    size_t num_failed = 0;
+    for (size_t i = 0; i < library.num_files; i++)
+    {
+        switch (library.files[i].status)
+        {
+        case FILE_COMPILED:
+            num_compiled++;
+            break;
+        case FILE_SKIPPED:
+            num_skipped++;
+            break;
+        default:
+            num_failed++;
+            break;
+        }
+    }
+
+    const bool index_written = write_index(&library, directory);
+    if (!index_written)
+        fprintf(stderr, "Could not write the index in %s\n", directory);
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    const double elapsed = (double)(end_time.tv_sec - start_time.tv_sec)
+                           + (double)(end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+    printf("%zu files: %zu compiled, %zu up to date, %zu failed in %.3f s on %ld threads\n",
+           library.num_files, num_compiled, num_skipped, num_failed, elapsed, num_started > 0 ? num_started : 1);
+
+    free(library.files);
+    return (num_failed == 0 && index_written) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,485 @@
+/*
+  Beatbox LV2 plugin
+
+  Copyright 2019, Paul Ferrand <paul@ferrand.cc>
+
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "beatbox_pattern.h"
+
+#include "lv2/midi/midi.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BEATBOX_CACHE_MAGIC "BBXCACHE"
+#define BEATBOX_CACHE_VERSION 2
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+// Header of a cache file, followed by the pattern up to its last event
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pattern_size; ///< Guards against a cache written with another layout of the pattern
+    uint32_t data_size;
+    uint32_t channel;
+    uint64_t hash;
+} beatbox_cache_header_t;
+
+// A track of the beat description before compilation
+typedef struct
+{
+    uint8_t note;
+    uint8_t velocity;
+    bool fill;
+    bool hits[MAX_STEPS];
+    uint64_t conditions[MAX_STEPS];
+    uint32_t thresholds[MAX_STEPS];
+} beatbox_track_t;
+
+// Parse a step condition: A:B plays on the A-th of every B loops, P% plays with a probability
+// of P percent, fill plays only when a fill is pending or playing and !fill only otherwise.
+// Several conditions on the same step must all hold.
+static bool
+beatbox_parse_condition(const char *condition, uint64_t *mask, uint32_t *threshold)
+{
+    unsigned int phase, period, percent;
+    int length = -1;
+    if (!strcmp(condition, "fill"))
+    {
+        *mask |= CONDITION_FILL;
+    }
+    else if (!strcmp(condition, "!fill"))
+    {
+        *mask |= CONDITION_NOT_FILL;
+    }
+    else if (sscanf(condition, "%u:%u%n", &phase, &period, &length) == 2 && condition[length] == '\0')
+    {
+        if (phase < 1 || phase > period || period > MAX_LOOP_PERIOD)
+            return false;
+        *mask |= CONDITION_LOOP_BIT(phase - 1, period);
+    }
+    else if (sscanf(condition, "%u%%%n", &percent, &length) == 1 && length > 0 && condition[length] == '\0')
+    {
+        if (percent < 1 || percent > 100)
+            return false;
+        *threshold = (uint32_t)((uint64_t)*threshold * percent / 100);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// FNV-1a
+static uint64_t
+beatbox_hash(const char *data, size_t size)
+{
+    uint64_t value = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < size; i++)
+    {
+        value ^= (unsigned char)data[i];
+        value *= FNV_PRIME;
+    }
+    return value;
+}
+
+char *
+beatbox_pattern_read(const char *path, size_t *size, uint64_t *hash)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    char *data = NULL;
+    size_t capacity = 0;
+    bool success = true;
+    *size = 0;
+    for (;;)
+    {
+        if (*size == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 4096;
+            char *grown = (char *)realloc(data, capacity);
+            if (!grown)
+            {
+                success = false;
+                break;
+            }
+            data = grown;
+        }
+        const size_t read = fread(data + *size, 1, capacity - *size, file);
+        if (read == 0)
+            break;
+        *size += read;
+    }
+
+    success = success && !ferror(file);
+    fclose(file);
+    if (!success)
+    {
+        free(data);
+        return NULL;
+    }
+    *hash = beatbox_hash(data, *size);
+    return data;
+}
+
+// Same as fgets() on the file content: copy the next line, newline included, and at most size - 1 characters
+static bool
+beatbox_next_line(char *line, size_t size, const char *data, size_t data_size, size_t *position)
+{
+    if (*position == data_size)
+        return false;
+
+    size_t length = 0;
+    while (length < size - 1 && *position < data_size)
+    {
+        const char c = data[(*position)++];
+        line[length++] = c;
+        if (c == '\n')
+            break;
+    }
+    line[length] = '\0';
+    return true;
+}
+
+// This runs in the worker thread, in the main thread upon restore, or in the compile tool
+beatbox_pattern_t *
+beatbox_pattern_compile(LV2_Log_Logger *logger, const char *path, const char *data, size_t size, unsigned int channel)
+{
+    beatbox_pattern_t *pattern = (beatbox_pattern_t *)calloc(1, sizeof(beatbox_pattern_t));
+    if (!pattern)
+        return NULL;
+
+    strncpy(pattern->path, path, MAX_PATH_SIZE - 1);
+    pattern->tempo = DEFAULT_TEMPO;
+    pattern->division = DEFAULT_DIVISION;
+
+    // Instruments go to the first output port on the default channel unless routed elsewhere
+    uint8_t route_port[128];
+    uint8_t route_channel[128];
+    memset(route_port, 0, sizeof(route_port));
+    memset(route_channel, (int)(channel - 1) & CHANNEL_MASK, sizeof(route_channel));
+
+    beatbox_track_t *tracks = (beatbox_track_t *)calloc(MAX_TRACKS, sizeof(beatbox_track_t));
+    if (!tracks)
+    {
+        free(pattern);
+        return NULL;
+    }
+
+    unsigned int num_tracks = 0;
+    unsigned int line_number = 0;
+    char line[MAX_LINE_SIZE];
+    size_t position = 0;
+    bool error = false;
+    while (!error && beatbox_next_line(line, sizeof(line), data, size, &position))
+    {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char keyword[32];
+        if (sscanf(line, " %31s", keyword) != 1)
+            continue;
+
+        if (!strcmp(keyword, "tempo"))
+        {
+            error = sscanf(line, " tempo %f", &pattern->tempo) != 1
+                    || pattern->tempo < MIN_TEMPO || pattern->tempo > MAX_TEMPO;
+        }
+        else if (!strcmp(keyword, "division"))
+        {
+            error = sscanf(line, " division %u", &pattern->division) != 1
+                    || pattern->division == 0 || pattern->division > MAX_STEPS;
+        }
+        else if (!strcmp(keyword, "route"))
+        {
+            int note, port, route_ch, length;
+            int offset = 0;
+            int num_values = sscanf(line, " route %d %d %n", &note, &port, &offset);
+            const char *c = &line[offset];
+            if (num_values == 2 && sscanf(c, "%d %n", &route_ch, &length) == 1)
+            {
+                num_values++;
+                c += length;
+            }
+
+            // Anything else left on the line is an error, as for the tracks
+            char rest[2];
+            error = num_values < 2 || note < 0 || note > 127 || port < 1 || port > NUM_OUTPUT_PORTS
+                    || (num_values == 3 && (route_ch < 1 || route_ch > 16))
+                    || sscanf(c, " %1s", rest) == 1;
+            if (!error)
+            {
+                route_port[note] = (uint8_t)(port - 1);
+                if (num_values == 3)
+                    route_channel[note] = (uint8_t)(route_ch - 1);
+            }
+        }
+        else
+        {
+            // A track line: [fill] <note> <velocity> <steps> [<step>=<condition> ...]
+            const bool fill = !strcmp(keyword, "fill");
+            const char *track_line = fill ? strstr(line, "fill") + 4 : line;
+            int note, velocity, offset;
+            error = num_tracks == MAX_TRACKS
+                    || sscanf(track_line, " %d %d %n", &note, &velocity, &offset) != 2
+                    || note < 0 || note > 127 || velocity < 1 || velocity > 127;
+            if (error)
+                break;
+
+            beatbox_track_t *track = &tracks[num_tracks++];
+            track->note = (uint8_t)note;
+            track->velocity = (uint8_t)velocity;
+            track->fill = fill;
+            for (unsigned int s = 0; s < MAX_STEPS; s++)
+                track->thresholds[s] = CONDITION_ALWAYS_PLAYS;
+            unsigned int *num_steps = fill ? &pattern->num_fill_steps : &pattern->num_steps;
+            unsigned int step = 0;
+            const char *c = &track_line[offset];
+            for (; *c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r'; c++, step++)
+            {
+                if (step == MAX_STEPS || (*c != 'x' && *c != 'X' && *c != '.' && *c != '-'))
+                {
+                    error = true;
+                    break;
+                }
+                track->hits[step] = (*c == 'x' || *c == 'X');
+            }
+            if (step > *num_steps)
+                *num_steps = step;
+
+            unsigned int condition_step;
+            char condition[16];
+            int length;
+            while (!error && sscanf(c, " %u=%15s%n", &condition_step, condition, &length) == 2)
+            {
+                c += length;
+                error = condition_step < 1 || condition_step > step || !track->hits[condition_step - 1]
+                        || !beatbox_parse_condition(condition,
+                                                    &track->conditions[condition_step - 1],
+                                                    &track->thresholds[condition_step - 1]);
+            }
+
+            // Anything else left on the line is an error
+            char rest[2];
+            error = error || sscanf(c, " %1s", rest) == 1;
+        }
+    }
+
+    if (error)
+    {
+        lv2_log_error(logger, "[pattern_compile] Error in %s at line %u\n", path, line_number);
+        free(tracks);
+        free(pattern);
+        return NULL;
+    }
+
+    if (pattern->num_steps == 0)
+    {
+        lv2_log_error(logger, "[pattern_compile] No steps found in %s\n", path);
+        free(tracks);
+        free(pattern);
+        return NULL;
+    }
+
+    // Compile the tracks into a flat list of events per step, the main loop first and then the
+    // fill. Each step holds its note ons followed by the note offs releasing them, which are
+    // played on the next step whichever section it belongs to.
+    const unsigned int total_steps = pattern->num_steps + pattern->num_fill_steps;
+    unsigned int num_events = 0;
+    for (unsigned int s = 0; s < total_steps; s++)
+    {
+        const bool fill = s >= pattern->num_steps;
+        const unsigned int step = fill ? s - pattern->num_steps : s;
+        pattern->step_index[s] = num_events;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            const bool note_on = pass == 0;
+            if (!note_on)
+                pattern->release_index[s] = num_events;
+
+            for (unsigned int t = 0; t < num_tracks; t++)
+            {
+                const beatbox_track_t *track = &tracks[t];
+                if (track->fill != fill || !track->hits[step])
+                    continue;
+
+                if (num_events == MAX_PATTERN_EVENTS)
+                {
+                    lv2_log_error(logger, "[pattern_compile] Too many events in %s\n", path);
+                    free(tracks);
+                    free(pattern);
+                    return NULL;
+                }
+
+                beatbox_event_t *event = &pattern->events[num_events++];
+                event->port = route_port[track->note];
+                event->status = (note_on ? LV2_MIDI_MSG_NOTE_ON : LV2_MIDI_MSG_NOTE_OFF) | route_channel[track->note];
+                event->note = track->note;
+                event->velocity = note_on ? track->velocity : 0;
+
+                // Note offs are unconditional; releasing a note that did not play is harmless
+                event->threshold = note_on ? track->thresholds[step] : CONDITION_ALWAYS_PLAYS;
+                event->condition = note_on ? track->conditions[step] : 0;
+            }
+        }
+    }
+    pattern->step_index[total_steps] = num_events;
+    pattern->fill_start = (pattern->num_steps - pattern->num_fill_steps % pattern->num_steps) % pattern->num_steps;
+    free(tracks);
+
+    lv2_log_note(logger, "[pattern_compile] Compiled %s: %u steps, %u fill steps, %u events\n",
+                 path, pattern->num_steps, pattern->num_fill_steps, num_events);
+    return pattern;
+}
+
+static void
+beatbox_cache_path(char *cache_path, size_t size, const char *path)
+{
+    snprintf(cache_path, size, "%s%s", path, BEATBOX_CACHE_SUFFIX);
+}
+
+// A cache file could be truncated or corrupted, so check everything run() will index with
+static bool
+beatbox_pattern_check(const beatbox_pattern_t *pattern, uint32_t data_size)
+{
+    if (pattern->num_steps == 0 || pattern->num_steps > MAX_STEPS
+        || pattern->num_fill_steps > MAX_STEPS || pattern->fill_start >= pattern->num_steps
+        || pattern->tempo < MIN_TEMPO || pattern->tempo > MAX_TEMPO
+        || pattern->division == 0 || pattern->division > MAX_STEPS)
+        return false;
+
+    const unsigned int total_steps = pattern->num_steps + pattern->num_fill_steps;
+    const unsigned int num_events = pattern->step_index[total_steps];
+    if (num_events > MAX_PATTERN_EVENTS
+        || data_size != offsetof(beatbox_pattern_t, events) + num_events * sizeof(beatbox_event_t))
+        return false;
+
+    for (unsigned int s = 0; s < total_steps; s++)
+    {
+        if (pattern->step_index[s] > pattern->release_index[s]
+            || pattern->release_index[s] > pattern->step_index[s + 1])
+            return false;
+    }
+
+    for (unsigned int i = 0; i < num_events; i++)
+    {
+        if (pattern->events[i].port >= NUM_OUTPUT_PORTS)
+            return false;
+    }
+
+    return true;
+}
+
+beatbox_pattern_t *
+beatbox_pattern_read_cache(const char *path, uint64_t hash, unsigned int channel)
+{
+    char cache_path[MAX_PATH_SIZE + sizeof(BEATBOX_CACHE_SUFFIX)];
+    beatbox_cache_path(cache_path, sizeof(cache_path), path);
+    FILE *file = fopen(cache_path, "rb");
+    if (!file)
+        return NULL;
+
+    beatbox_cache_header_t header;
+    beatbox_pattern_t *pattern = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1
+        && !memcmp(header.magic, BEATBOX_CACHE_MAGIC, sizeof(header.magic))
+        && header.version == BEATBOX_CACHE_VERSION
+        && header.pattern_size == sizeof(beatbox_pattern_t)
+        && header.data_size <= sizeof(beatbox_pattern_t)
+        && header.channel == channel
+        && header.hash == hash)
+    {
+        pattern = (beatbox_pattern_t *)calloc(1, sizeof(beatbox_pattern_t));
+        if (pattern && (fread(pattern, header.data_size, 1, file) != 1 || !beatbox_pattern_check(pattern, header.data_size)))
+        {
+            free(pattern);
+            pattern = NULL;
+        }
+    }
+    fclose(file);
+
+    // The library may have moved since the cache was built
+    if (pattern)
+    {
+        strncpy(pattern->path, path, MAX_PATH_SIZE - 1);
+        pattern->path[MAX_PATH_SIZE - 1] = '\0';
+    }
+    return pattern;
+}
+
+bool
+beatbox_pattern_write_cache(const beatbox_pattern_t *pattern, uint64_t hash, unsigned int channel)
+{
+    char cache_path[MAX_PATH_SIZE + sizeof(BEATBOX_CACHE_SUFFIX)];
+    char temp_path[MAX_PATH_SIZE + sizeof(BEATBOX_CACHE_SUFFIX) + 4];
+    beatbox_cache_path(cache_path, sizeof(cache_path), pattern->path);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", cache_path);
+
+    const unsigned int num_events = pattern->step_index[pattern->num_steps + pattern->num_fill_steps];
+    beatbox_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BEATBOX_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BEATBOX_CACHE_VERSION;
+    header.pattern_size = sizeof(beatbox_pattern_t);
+    header.data_size = (uint32_t)(offsetof(beatbox_pattern_t, events) + num_events * sizeof(beatbox_event_t));
+    header.channel = channel;
+    header.hash = hash;
+
+    FILE *file = fopen(temp_path, "wb");
+    if (!file)
+        return false;
+
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1
+                   && fwrite(pattern, header.data_size, 1, file) == 1;
+    success = fclose(file) == 0 && success;
+
+    // Readers either see the old cache or the new one, never a partial file
+    if (success)
+        success = rename(temp_path, cache_path) == 0;
+    if (!success)
+        remove(temp_path);
+    return success;
+}
+
+beatbox_pattern_t *
+beatbox_pattern_load(LV2_Log_Logger *logger, const char *path, unsigned int channel)
+{
+    size_t size;
+    uint64_t hash;
+    char *data = beatbox_pattern_read(path, &size, &hash);
+    if (!data)
+    {
+        lv2_log_error(logger, "[pattern_load] Could not read %s\n", path);
+        return NULL;
+    }
+
+    // The cache is checked against the content that would be parsed otherwise
+    beatbox_pattern_t *pattern = beatbox_pattern_read_cache(path, hash, channel);
+    if (pattern)
+        lv2_log_note(logger, "[pattern_load] Read %s from its cache\n", path);
+    else
+        pattern = beatbox_pattern_compile(logger, path, data, size, channel);
+    free(data);
+    return pattern;
+}
@@ -0,0 +1,98 @@
+/*
+  Beatbox LV2 plugin
+
+  Copyright 2019, Paul Ferrand <paul@ferrand.cc>
+
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+// Beat description parser and compiled pattern cache, shared by the plugin
+// and the beatbox-compile tool.
+
+#pragma once
+
+#include "lv2/log/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHANNEL_MASK 0x0F
+#define MAX_PATH_SIZE 1024
+#define DEFAULT_TEMPO 120.0f
+#define DEFAULT_DIVISION 4
+#define MIN_TEMPO 1.0f
+#define MAX_TEMPO 1000.0f
+#define NUM_OUTPUT_PORTS 4
+#define MAX_STEPS 256
+#define MAX_TRACKS 64
+#define MAX_PATTERN_EVENTS 4096
+#define MAX_LINE_SIZE 1024
+#define BEATBOX_CACHE_SUFFIX ".bbc"
+#define DEFAULT_OUTPUT_CHANNEL 10
+
+// Step conditions are compiled into bits that must all be set in the state computed by run()
+// for each step. The loop bits hold, for every period up to MAX_LOOP_PERIOD, the position of
+// the current loop in that period.
+#define MAX_LOOP_PERIOD 8
+#define CONDITION_LOOP_BIT(phase, period) (1ull << ((period) * ((period) - 1) / 2 + (phase)))
+#define CONDITION_FILL (1ull << 36)
+#define CONDITION_NOT_FILL (1ull << 37)
+#define CONDITION_ALWAYS_PLAYS UINT32_MAX
+
+// A MIDI event as it will be forged in the output; the routing is resolved at compile time
+typedef struct
+{
+    uint8_t port;     ///< Output port index
+    uint8_t status;   ///< MIDI status byte, channel included
+    uint8_t note;
+    uint8_t velocity;
+    uint32_t threshold; ///< The event plays if a random 32-bit value is at most this
+    uint64_t condition; ///< Condition bits that must all be set for the event to play
+} beatbox_event_t;
+
+// A compiled pattern, built by the worker or read from the cache, and swapped in the audio thread
+typedef struct
+{
+    char path[MAX_PATH_SIZE];
+    float tempo;
+    unsigned int division;
+    unsigned int num_steps;      ///< Steps of the main loop
+    unsigned int num_fill_steps; ///< Steps of the fill, stored after the main loop
+    unsigned int fill_start;     ///< Step of the main loop where the fill starts so that it ends on the downbeat
+    unsigned int step_index[2 * MAX_STEPS + 1]; ///< First note on of each step; the note ons of step s are in [step_index[s], release_index[s])
+    unsigned int release_index[2 * MAX_STEPS];  ///< First note off of each step, releasing its note ons on the next step; they end at step_index[s + 1]
+    beatbox_event_t events[MAX_PATTERN_EVENTS];
+} beatbox_pattern_t;
+
+// Read a beat description in memory and hash it, so that its cache is checked against the same
+// content that gets compiled. Returns NULL on error; the buffer is freed with free().
+char *
+beatbox_pattern_read(const char *path, size_t *size, uint64_t *hash);
+
+// Compile a beat description read by beatbox_pattern_read(); the path is only used in the logs.
+// Returns NULL on error; the pattern is freed with free().
+beatbox_pattern_t *
+beatbox_pattern_compile(LV2_Log_Logger *logger, const char *path, const char *data, size_t size, unsigned int channel);
+
+// Load a beat description, from its cache if it is up to date or by compiling it otherwise.
+beatbox_pattern_t *
+beatbox_pattern_load(LV2_Log_Logger *logger, const char *path, unsigned int channel);
+
+// Read the cache of a beat description if it was built from the same content and channel.
+beatbox_pattern_t *
+beatbox_pattern_read_cache(const char *path, uint64_t hash, unsigned int channel);
+
+// Write the cache next to the beat description; the cache is replaced atomically.
+bool
+beatbox_pattern_write_cache(const beatbox_pattern_t *pattern, uint64_t hash, unsigned int channel);
@@ -0,0 +1,570 @@
+/*
+  Beatbox LV2 plugin
+
+  Copyright 2019, Paul Ferrand <paul@ferrand.cc>
+
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+// Timing regression test: hosts the plugin in process, plays tests/timing.beat
+// with several block sizes and sample rates through the same transport changes,
+// fill requests and sample rate change, and checks that the event streams do not
+// depend on the block size and that the steps land on their exact frames.
+//
+// Usage: beatbox-timing-test <beat file>
+
+#include "lv2/atom/util.h"
+#include "lv2/buf-size/buf-size.h"
+#include "lv2/core/lv2.h"
+#include "lv2/midi/midi.h"
+#include "lv2/options/options.h"
+#include "lv2/parameters/parameters.h"
+#include "lv2/state/state.h"
+#include "lv2/urid/urid.h"
+#include "lv2/worker/worker.h"
+
+#include "beatbox_pattern.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BEATBOX__beatDescription "http://sfztools.github.io/beatbox:beatdescription"
+
+// Port indices, as declared in beatbox.ttl
+#define INPUT_PORT 0
+#define OUTPUT_PORT 1
+#define OUTPUT_CHANNEL_PORT 2
+#define MAIN_SWITCH_PORT 3
+#define ACCENT_SWITCH_PORT 4
+#define OUTPUT_PORT_2 5
+#define LOOKAHEAD_PORT 8
+#define LATENCY_PORT 9
+
+// Tempo in thousandths of a BPM and division of tests/timing.beat, the note hitting every step
+// in the main loop and in the fill, and the fill note with its velocity and hits per fill
+#define PATTERN_TEMPO 133700ull
+#define PATTERN_DIVISION 4ull
+#define PATTERN_NOTE 36
+#define FILL_NOTE 38
+#define FILL_VELOCITY 110
+#define FILL_HITS 2
+
+#define MAX_URIS 256
+#define MAX_BLOCK_SIZE 8192
+#define OUTPUT_BUFFER_SIZE 65536
+#define WORKER_BUFFER_SIZE 65536
+#define MAX_RESPONSES 64
+
+// The actions happen on multiples of the least common multiple of the block sizes,
+// so that they fall on a block boundary in every configuration
+#define ACTION_PERIOD (8192ull * 17ull)
+#define NUM_PERIODS 9
+#define SAMPLE_RATE_FACTOR 0.5
+
+static const uint32_t block_sizes[] = { 1, 17, 64, 256, 4096, 8192 };
+static const double sample_rates[] = { 44100.0, 48000.0, 96000.0 };
+static const float lookaheads[] = { 0.0f, 10.0f };
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+typedef enum
+{
+    ACTION_MAIN = 0,    ///< Press the main switch, to start or stop
+    ACTION_ACCENT,      ///< Press the accent switch, to request a fill
+    ACTION_SAMPLE_RATE, ///< Multiply the sample rate by SAMPLE_RATE_FACTOR through the options interface
+} test_action_type_t;
+
+typedef struct
+{
+    uint64_t period;
+    test_action_type_t type;
+} test_action_t;
+
+// Each fill request is left enough time to play a whole fill at every tested sample rate
+static const test_action_t actions[] = {
+    { 0, ACTION_MAIN },
+    { 1, ACTION_ACCENT },
+    { 3, ACTION_MAIN },
+    { 4, ACTION_MAIN },
+    { 5, ACTION_ACCENT },
+    { 6, ACTION_SAMPLE_RATE },
+    { 7, ACTION_ACCENT },
+};
+
+typedef struct
+{
+    uint64_t frame;
+    uint32_t port;
+    uint32_t order; ///< Keeps the plugin order between events at the same frame on the same port
+    uint8_t msg[3];
+} test_event_t;
+
+typedef struct
+{
+    test_event_t *events;
+    size_t num_events;
+    size_t capacity;
+} test_stream_t;
+
+typedef struct
+{
+    const LV2_Descriptor *descriptor;
+    const LV2_Worker_Interface *worker;
+    LV2_Handle instance;
+    uint8_t responses[WORKER_BUFFER_SIZE];
+    uint32_t response_sizes[MAX_RESPONSES];
+    uint32_t num_responses;
+    uint32_t responses_size;
+    const char *beat_file;
+} test_host_t;
+
+static const char *uris[MAX_URIS];
+static LV2_URID num_uris = 0;
+
+static LV2_URID
+test_map(LV2_URID_Map_Handle handle, const char *uri)
+{
+    (void)handle;
+    for (LV2_URID i = 0; i < num_uris; i++)
+        if (!strcmp(uris[i], uri))
+            return i + 1;
+
+    if (num_uris == MAX_URIS)
+        return 0;
+    uris[num_uris++] = uri;
+    return num_uris;
+}
+
+static const char *
+test_unmap(LV2_URID_Unmap_Handle handle, LV2_URID urid)
+{
+    (void)handle;
+    return (urid > 0 && urid <= num_uris) ? uris[urid - 1] : NULL;
+}
+
+// The worker runs synchronously and its responses are delivered after the block, as a host would
+static LV2_Worker_Status
+test_respond(LV2_Worker_Respond_Handle handle, uint32_t size, const void *data)
+{
+    test_host_t *host = (test_host_t *)handle;
+    if (host->num_responses == MAX_RESPONSES || host->responses_size + size > WORKER_BUFFER_SIZE)
+        return LV2_WORKER_ERR_NO_SPACE;
+
+    memcpy(host->responses + host->responses_size, data, size);
+    host->response_sizes[host->num_responses++] = size;
+    host->responses_size += size;
+    return LV2_WORKER_SUCCESS;
+}
+
+static LV2_Worker_Status
+test_schedule(LV2_Worker_Schedule_Handle handle, uint32_t size, const void *data)
+{
+    test_host_t *host = (test_host_t *)handle;
+    return host->worker->work(host->instance, test_respond, host, size, data);
+}
+
+static void
+test_deliver_responses(test_host_t *host)
+{
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < host->num_responses; i++)
+    {
+        host->worker->work_response(host->instance, host->response_sizes[i], host->responses + offset);
+        offset += host->response_sizes[i];
+    }
+    host->num_responses = 0;
+    host->responses_size = 0;
+}
+
+static const void *
+test_retrieve(LV2_State_Handle handle, uint32_t key, size_t *size, uint32_t *type, uint32_t *flags)
+{
+    test_host_t *host = (test_host_t *)handle;
+    if (key != test_map(NULL, BEATBOX__beatDescription))
+        return NULL;
+
+    *size = strlen(host->beat_file) + 1;
+    *type = test_map(NULL, LV2_ATOM__Path);
+    *flags = LV2_STATE_IS_POD;
+    return host->beat_file;
+}
+
+static bool
+test_stream_add(test_stream_t *stream, uint64_t frame, uint32_t port, const uint8_t *msg)
+{
+    if (stream->num_events == stream->capacity)
+    {
+        const size_t capacity = stream->capacity ? 2 * stream->capacity : 1024;
+        test_event_t *events = (test_event_t *)realloc(stream->events, capacity * sizeof(test_event_t));
+        if (!events)
+            return false;
+        stream->events = events;
+        stream->capacity = capacity;
+    }
+
+    test_event_t *event = &stream->events[stream->num_events];
+    event->frame = frame;
+    event->port = port;
+    event->order = (uint32_t)stream->num_events;
+    memcpy(event->msg, msg, sizeof(event->msg));
+    stream->num_events++;
+    return true;
+}
+
+static int
+test_compare_events(const void *lhs, const void *rhs)
+{
+    const test_event_t *a = (const test_event_t *)lhs;
+    const test_event_t *b = (const test_event_t *)rhs;
+    if (a->frame != b->frame)
+        return a->frame < b->frame ? -1 : 1;
+    if (a->port != b->port)
+        return a->port < b->port ? -1 : 1;
+    if (a->order != b->order)
+        return a->order < b->order ? -1 : 1;
+    return 0;
+}
+
+static uint64_t
+test_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Play the pattern for NUM_PERIODS action periods in blocks of block_size, applying the actions
+// at the start of their block, and collect the output events sorted by frame and port
+static bool
+test_play(const LV2_Descriptor *descriptor,
+          const char *beat_file,
+          double sample_rate,
+          uint32_t block_size,
+          float lookahead,
+          test_stream_t *stream,
+          float *latency,
+          uint64_t *elapsed_ns)
+{
+    static test_host_t host;
+    memset(&host, 0, sizeof(host));
+    host.descriptor = descriptor;
+    host.beat_file = beat_file;
+
+    LV2_URID_Map map = { NULL, test_map };
+    LV2_URID_Unmap unmap = { NULL, test_unmap };
+    LV2_Worker_Schedule schedule = { &host, test_schedule };
+    const int32_t max_block_size = MAX_BLOCK_SIZE;
+    const LV2_Options_Option options[] = {
+        { LV2_OPTIONS_INSTANCE, 0, test_map(NULL, LV2_BUF_SIZE__maxBlockLength),
+          sizeof(int32_t), test_map(NULL, LV2_ATOM__Int), &max_block_size },
+        { LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL },
+    };
+    const LV2_Feature map_feature = { LV2_URID__map, &map };
+    const LV2_Feature unmap_feature = { LV2_URID__unmap, &unmap };
+    const LV2_Feature schedule_feature = { LV2_WORKER__schedule, &schedule };
+    const LV2_Feature bounded_feature = { LV2_BUF_SIZE__boundedBlockLength, NULL };
+    const LV2_Feature options_feature = { LV2_OPTIONS__options, (void *)options };
+    const LV2_Feature *const features[] = {
+        &map_feature, &unmap_feature, &schedule_feature, &bounded_feature, &options_feature, NULL
+    };
+
+    host.instance = descriptor->instantiate(descriptor, sample_rate, "", features);
+    if (!host.instance)
+    {
+        fprintf(stderr, "Could not instantiate the plugin\n");
+        return false;
+    }
+    host.worker = (const LV2_Worker_Interface *)descriptor->extension_data(LV2_WORKER__interface);
+    const LV2_State_Interface *state = (const LV2_State_Interface *)descriptor->extension_data(LV2_STATE__interface);
+    const LV2_Options_Interface *options_interface =
+        (const LV2_Options_Interface *)descriptor->extension_data(LV2_OPTIONS__interface);
+    state->restore(host.instance, test_retrieve, &host, 0, NULL);
+
+    static uint64_t input[64];
+    static uint64_t outputs[NUM_OUTPUT_PORTS][OUTPUT_BUFFER_SIZE / sizeof(uint64_t)];
+    float output_channel = DEFAULT_OUTPUT_CHANNEL;
+    float main_switch = 0.0f;
+    float accent_switch = 0.0f;
+    float lookahead_control = lookahead;
+    LV2_Atom_Sequence *input_sequence = (LV2_Atom_Sequence *)input;
+    descriptor->connect_port(host.instance, INPUT_PORT, input);
+    descriptor->connect_port(host.instance, OUTPUT_PORT, outputs[0]);
+    descriptor->connect_port(host.instance, OUTPUT_CHANNEL_PORT, &output_channel);
+    descriptor->connect_port(host.instance, MAIN_SWITCH_PORT, &main_switch);
+    descriptor->connect_port(host.instance, ACCENT_SWITCH_PORT, &accent_switch);
+    for (uint32_t i = 1; i < NUM_OUTPUT_PORTS; i++)
+        descriptor->connect_port(host.instance, OUTPUT_PORT_2 + i - 1, outputs[i]);
+    descriptor->connect_port(host.instance, LOOKAHEAD_PORT, &lookahead_control);
+    descriptor->connect_port(host.instance, LATENCY_PORT, latency);
+    descriptor->activate(host.instance);
+
+    const LV2_URID midi_event = test_map(NULL, LV2_MIDI__MidiEvent);
+    const uint64_t total_frames = NUM_PERIODS * ACTION_PERIOD;
+    float new_sample_rate = (float)(sample_rate * SAMPLE_RATE_FACTOR);
+    const LV2_Options_Option sample_rate_options[] = {
+        { LV2_OPTIONS_INSTANCE, 0, test_map(NULL, LV2_PARAMETERS__sampleRate),
+          sizeof(float), test_map(NULL, LV2_ATOM__Float), &new_sample_rate },
+        { LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL },
+    };
+    bool success = true;
+    *elapsed_ns = 0;
+    for (uint64_t frame = 0; success && frame < total_frames; frame += block_size)
+    {
+        const uint32_t num_frames = (uint32_t)(frame + block_size > total_frames ? total_frames - frame : block_size);
+        input_sequence->atom.size = sizeof(LV2_Atom_Sequence_Body);
+        input_sequence->atom.type = test_map(NULL, LV2_ATOM__Sequence);
+        input_sequence->body.unit = 0;
+        input_sequence->body.pad = 0;
+        for (uint32_t i = 0; i < NUM_OUTPUT_PORTS; i++)
+            ((LV2_Atom_Sequence *)outputs[i])->atom.size = OUTPUT_BUFFER_SIZE - sizeof(LV2_Atom);
+        main_switch = 0.0f;
+        accent_switch = 0.0f;
+        for (size_t a = 0; a < ARRAY_SIZE(actions); a++)
+        {
+            if (actions[a].period * ACTION_PERIOD != frame)
+                continue;
+            if (actions[a].type == ACTION_MAIN)
+                main_switch = 1.0f;
+            else if (actions[a].type == ACTION_ACCENT)
+                accent_switch = 1.0f;
+            else
+                options_interface->set(host.instance, sample_rate_options);
+        }
+
+        const uint64_t start = test_time_ns();
+        descriptor->run(host.instance, num_frames);
+        *elapsed_ns += test_time_ns() - start;
+
+        for (uint32_t i = 0; success && i < NUM_OUTPUT_PORTS; i++)
+        {
+            const LV2_Atom_Sequence *output = (const LV2_Atom_Sequence *)outputs[i];
+            LV2_ATOM_SEQUENCE_FOREACH(output, ev)
+            {
+                if (ev->body.type != midi_event || ev->body.size != 3)
+                    continue;
+                if (ev->time.frames < 0 || ev->time.frames >= (int64_t)num_frames)
+                {
+                    fprintf(stderr, "Event at %lld out of a block of %u frames\n", (long long)ev->time.frames, num_frames);
+                    success = false;
+                    break;
+                }
+                success = test_stream_add(stream, frame + (uint64_t)ev->time.frames, i, (const uint8_t *)(ev + 1));
+            }
+        }
+        test_deliver_responses(&host);
+    }
+
+    descriptor->deactivate(host.instance);
+    descriptor->cleanup(host.instance);
+    qsort(stream->events, stream->num_events, sizeof(test_event_t), test_compare_events);
+    return success;
+}
+
+static uint64_t
+test_step_frames_num(double sample_rate)
+{
+    return 60ull * 1000ull * (uint64_t)(sample_rate + 0.5);
+}
+
+// Check the note ons of the note hitting every step from the anchor frame up to the end frame
+// against the exact rational step positions, and return the frame of the step after them
+static bool
+test_check_steps(const test_stream_t *stream,
+                 size_t *index,
+                 uint64_t anchor_frame,
+                 uint64_t end_frame,
+                 uint64_t step_frames_num,
+                 uint64_t *next_frame)
+{
+    const uint64_t step_frames_den = PATTERN_TEMPO * PATTERN_DIVISION;
+    const uint8_t note_on = LV2_MIDI_MSG_NOTE_ON | (DEFAULT_OUTPUT_CHANNEL - 1);
+    uint64_t step = 0;
+    uint64_t expected;
+    while ((expected = anchor_frame + step * step_frames_num / step_frames_den) < end_frame)
+    {
+        while (*index < stream->num_events)
+        {
+            const test_event_t *event = &stream->events[*index];
+            if (event->port == 0 && event->msg[0] == note_on && event->msg[1] == PATTERN_NOTE)
+                break;
+            (*index)++;
+        }
+
+        if (*index == stream->num_events)
+        {
+            fprintf(stderr, "Missing the step at frame %llu\n", (unsigned long long)expected);
+            return false;
+        }
+
+        const uint64_t frame = stream->events[(*index)++].frame;
+        if (frame != expected)
+        {
+            fprintf(stderr, "Step at frame %llu instead of %llu\n",
+                    (unsigned long long)frame, (unsigned long long)expected);
+            return false;
+        }
+        step++;
+    }
+    *next_frame = expected;
+    return true;
+}
+
+// Follow the actions to check that every step is played exactly on its rational position, counted
+// from the frame where playback starts whatever the lookahead, and re-anchored on the next step
+// when the sample rate changes
+static bool
+test_check_drift(const test_stream_t *stream, double sample_rate)
+{
+    size_t index = 0;
+    bool playing = false;
+    uint64_t anchor_frame = 0;
+    uint64_t step_frames_num = test_step_frames_num(sample_rate);
+    uint64_t next_frame;
+    for (size_t a = 0; a < ARRAY_SIZE(actions); a++)
+    {
+        const uint64_t frame = actions[a].period * ACTION_PERIOD;
+        if (actions[a].type == ACTION_MAIN)
+        {
+            if (playing && !test_check_steps(stream, &index, anchor_frame, frame, step_frames_num, &next_frame))
+                return false;
+            playing = !playing;
+            anchor_frame = frame;
+        }
+        else if (actions[a].type == ACTION_SAMPLE_RATE)
+        {
+            if (playing)
+            {
+                if (!test_check_steps(stream, &index, anchor_frame, frame, step_frames_num, &next_frame))
+                    return false;
+                anchor_frame = next_frame;
+            }
+            step_frames_num = test_step_frames_num(sample_rate * SAMPLE_RATE_FACTOR);
+        }
+    }
+
+    if (playing && !test_check_steps(stream, &index, anchor_frame, NUM_PERIODS * ACTION_PERIOD, step_frames_num, &next_frame))
+        return false;
+    return true;
+}
+
+// Every fill request must give a whole fill, whose steps follow their fill and !fill conditions
+static bool
+test_check_fills(const test_stream_t *stream)
+{
+    size_t num_fills = 0;
+    for (size_t a = 0; a < ARRAY_SIZE(actions); a++)
+        num_fills += actions[a].type == ACTION_ACCENT;
+
+    size_t num_hits = 0;
+    for (size_t i = 0; i < stream->num_events; i++)
+    {
+        const test_event_t *event = &stream->events[i];
+        num_hits += (event->msg[0] & 0xF0) == LV2_MIDI_MSG_NOTE_ON && event->msg[1] == FILL_NOTE
+                    && event->msg[2] == FILL_VELOCITY;
+    }
+
+    if (num_hits != num_fills * FILL_HITS)
+    {
+        fprintf(stderr, "Got %zu fill hits instead of %zu\n", num_hits, num_fills * FILL_HITS);
+        return false;
+    }
+    return true;
+}
+
+static bool
+test_same_streams(const test_stream_t *reference, const test_stream_t *stream)
+{
+    const size_t num_events = reference->num_events < stream->num_events ? reference->num_events : stream->num_events;
+    for (size_t i = 0; i < num_events; i++)
+    {
+        const test_event_t *a = &reference->events[i];
+        const test_event_t *b = &stream->events[i];
+        if (a->frame != b->frame || a->port != b->port || memcmp(a->msg, b->msg, sizeof(a->msg)))
+        {
+            fprintf(stderr, "Event %zu differs: frame %llu port %u %02x %u %u instead of frame %llu port %u %02x %u %u\n",
+                    i, (unsigned long long)b->frame, b->port, b->msg[0], b->msg[1], b->msg[2],
+                    (unsigned long long)a->frame, a->port, a->msg[0], a->msg[1], a->msg[2]);
+            return false;
+        }
+    }
+
+    if (reference->num_events != stream->num_events)
+    {
+        fprintf(stderr, "Got %zu events instead of %zu\n", stream->num_events, reference->num_events);
+        return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <beat file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const LV2_Descriptor *descriptor = lv2_descriptor(0);
+    if (!descriptor)
+    {
+        fprintf(stderr, "No plugin descriptor\n");
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    for (size_t r = 0; r < ARRAY_SIZE(sample_rates); r++)
+    {
+        for (size_t l = 0; l < ARRAY_SIZE(lookaheads); l++)
+        {
+            const double sample_rate = sample_rates[r];
+            const uint32_t lookahead_frames = (uint32_t)(lookaheads[l] * sample_rate / 1000.0);
+            test_stream_t reference = { NULL, 0, 0 };
+            for (size_t b = 0; b < ARRAY_SIZE(block_sizes); b++)
+            {
+                test_stream_t stream = { NULL, 0, 0 };
+                float latency = -1.0f;
+                uint64_t elapsed_ns;
+                bool success = test_play(descriptor, argv[1], sample_rate, block_sizes[b], lookaheads[l],
+                                         &stream, &latency, &elapsed_ns);
+                if (success && (uint32_t)latency != lookahead_frames)
+                {
+                    fprintf(stderr, "Reported a latency of %g frames instead of %u\n", latency, lookahead_frames);
+                    success = false;
+                }
+                success = success && test_check_drift(&stream, sample_rate) && test_check_fills(&stream);
+                // The first block size is the reference for the others
+                if (b == 0)
+                    reference = stream;
+                else
+                    success = success && test_same_streams(&reference, &stream);
+
+                printf("%-4s %6.0f Hz, lookahead %4u, block %4u: %6zu events in %8.3f ms (%.1f ns/frame)\n",
+                       success ? "ok" : "FAIL", sample_rate, lookahead_frames, block_sizes[b], stream.num_events,
+                       (double)elapsed_ns * 1e-6, (double)elapsed_ns / (double)(NUM_PERIODS * ACTION_PERIOD));
+                if (!success)
+                    failures++;
+                if (b != 0)
+                    free(stream.events);
+            }
+            free(reference.events);
+        }
+    }
+
+    printf("%d failed\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}